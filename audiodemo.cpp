@@ -17,6 +17,14 @@
 #include <math.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <utils/Timers.h>
 
 #include <media/AudioSystem.h>
 #include <media/AudioTrack.h>
@@ -24,6 +32,8 @@
 
 #include <audio_utils/resampler.h>
 
+#include "audiodemo.h"
+
 namespace android {
 
 /************************************************************
@@ -32,81 +42,212 @@ namespace android {
 *
 ************************************************************/
 
-audio_source_t      gInDevice = AUDIO_SOURCE_MIC;
-audio_stream_type_t gOutDevice = AUDIO_STREAM_MUSIC;
-
 #define         CHANNEL_NUM     2
 #define         SAMPLE_RATE     44100
 #define         SAMPLE_BITS     16
 #define         SINE_FREQ       500
 #define         SINE_TIME_SEC   60
 
-int             gInChannelNum = -1;
-int             gOutChannelNum = -1;
+char            gTraceFile[512] = "";
+bool            gTraceEnabled = false;
 
-int             gInSampleRate = -1;
-int             gOutSampleRate = -1;
+#undef RAMP_VOLUME
 
-int             gInBits = -1;
-int             gOutBits = -1;
+AudioDemo::AudioDemo(void)
+    : mInDevice(AUDIO_SOURCE_MIC),
+      mOutDevice(AUDIO_STREAM_MUSIC),
+      mInChannelNum(-1),
+      mOutChannelNum(-1),
+      mInSampleRate(-1),
+      mOutSampleRate(-1),
+      mInBits(-1),
+      mOutBits(-1),
+      mResample(-1),
+      mSineFreq(-1),
+      mSineTime(SINE_TIME_SEC),
+      mSeekFrame(-1),
+      mSeekMs(-1),
+      mRepack(false),
+      mAppend(false),
+      mFrameCount(-1),
+      mLoop(false),
+      mReportSec(-1),
+      mPlaying(false),
+      mRecording(false)
+{
+    mInFile[0] = 0;
+    mOutFile[0] = 0;
+}
 
-char            gInFile[512] = "";
-char            gOutFile[512] = "";
+bool AudioDemo::Stop()
+{
+    if (!mPlaying && !mRecording)
+        return false;
 
-bool            isPlaying = false;
-bool            isRecording = false;
+    mPlaying = false;
+    mRecording = false;
+    return true;
+}
 
-int             gResample = -1;
-int             gSineFreq = -1;
-int             gSineTime = SINE_TIME_SEC;
+static const PcmParams kDefaultParams = { CHANNEL_NUM, SAMPLE_RATE, SAMPLE_BITS };
 
-#undef RAMP_VOLUME
+// Take the configured value of each field, or the fallback where it is unset.
+static PcmParams resolveParams(int channels, int sampleRate, int bits, const PcmParams& fallback)
+{
+    PcmParams params;
+    params.channels = channels < 0 ? fallback.channels : channels;
+    params.sampleRate = sampleRate < 0 ? fallback.sampleRate : sampleRate;
+    params.bits = bits < 0 ? fallback.bits : bits;
+    return params;
+}
+
+/************************************************************
+*
+*    Trace
+*
+*    TRACE_SCOPE() records a complete event per scope into a
+*    ring owned by the calling thread; buffers are linked on
+*    first use and written as Chrome trace JSON (loadable by
+*    Perfetto) by DumpTrace(). Once a ring is full the oldest
+*    events are overwritten, so a long run keeps its most recent
+*    history. With --trace unset a scope costs a single branch.
+*
+************************************************************/
+
+#define         TRACE_EVENTS_PER_THREAD     (64*1024)   // power of two
+
+typedef struct TRACE_EVENT{
+    const char* name;
+    nsecs_t     begin;
+    nsecs_t     end;
+}TRACE_EVENT;
+
+typedef struct TRACE_BUFFER{
+    struct TRACE_BUFFER* next;
+    pid_t       tid;
+    uint32_t    count;      // events ever recorded, published with release
+    TRACE_EVENT events[TRACE_EVENTS_PER_THREAD];
+}TRACE_BUFFER;
+
+static TRACE_BUFFER*            gTraceBuffers = NULL;
+static __thread TRACE_BUFFER*   tTraceBuffer = NULL;
+
+static void traceRecord(const char* name, nsecs_t begin, nsecs_t end)
+{
+    TRACE_BUFFER* buf = tTraceBuffer;
+    if (buf == NULL) {
+        buf = (TRACE_BUFFER*)calloc(1, sizeof(TRACE_BUFFER));
+        if (buf == NULL)
+            return;
+        buf->tid = gettid();
+        buf->next = __atomic_load_n(&gTraceBuffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&gTraceBuffers, &buf->next, buf,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        tTraceBuffer = buf;
+    }
+
+    uint32_t count = buf->count;
+    TRACE_EVENT* e = &buf->events[count & (TRACE_EVENTS_PER_THREAD - 1)];
+    e->name = name;
+    e->begin = begin;
+    e->end = end;
+    __atomic_store_n(&buf->count, count + 1, __ATOMIC_RELEASE);
+}
+
+class TraceScope {
+public:
+    explicit TraceScope(const char* name)
+        : mName(gTraceEnabled ? name : NULL),
+          mBegin(gTraceEnabled ? systemTime(SYSTEM_TIME_MONOTONIC) : 0) {}
+    ~TraceScope() {
+        if (mName != NULL)
+            traceRecord(mName, mBegin, systemTime(SYSTEM_TIME_MONOTONIC));
+    }
+private:
+    const char* mName;
+    nsecs_t     mBegin;
+};
+
+#define         TRACE_CONCAT_(a, b)     a##b
+#define         TRACE_CONCAT(a, b)      TRACE_CONCAT_(a, b)
+#define         TRACE_SCOPE(name)       TraceScope TRACE_CONCAT(__traceScope, __LINE__)(name)
+
+void DumpTrace(void)
+{
+    if (!gTraceEnabled)
+        return;
+
+    FILE* fp = fopen(gTraceFile, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to create trace file: %s\n", gTraceFile);
+        return;
+    }
+
+    pid_t pid = getpid();
+    uint32_t total = 0;
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (TRACE_BUFFER* buf = __atomic_load_n(&gTraceBuffers, __ATOMIC_ACQUIRE);
+            buf != NULL; buf = buf->next) {
+        uint32_t count = __atomic_load_n(&buf->count, __ATOMIC_ACQUIRE);
+        uint32_t first = count > TRACE_EVENTS_PER_THREAD ? count - TRACE_EVENTS_PER_THREAD : 0;
+        for (uint32_t i = first; i < count; i++) {
+            const TRACE_EVENT* e = &buf->events[i & (TRACE_EVENTS_PER_THREAD - 1)];
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3f,\"dur\":%.3f}\n", total++ ? "," : "",
+                    e->name, pid, buf->tid, e->begin/1000.0, (e->end - e->begin)/1000.0);
+        }
+        if (first > 0)
+            fprintf(stderr, "trace: thread %d wrapped, %u oldest events overwritten\n",
+                    buf->tid, first);
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
 
-int CheckPlaybackParams()
+    printf("trace: %u events written to %s\n", total, gTraceFile);
+}
+
+int AudioDemo::CheckPlaybackParams(const PcmParams& out)
 {
-    if (gOutDevice<AUDIO_STREAM_DEFAULT || gOutDevice>AUDIO_STREAM_PUBLIC_CNT)
+    if (mOutDevice<AUDIO_STREAM_DEFAULT || mOutDevice>AUDIO_STREAM_PUBLIC_CNT)
         return -1;
 
-    if (gOutChannelNum!=1 && gOutChannelNum!=2)
+    if (out.channels!=1 && out.channels!=2)
         return -2;
 
-    if (gOutBits!=8 && gOutBits!=16 && gOutBits!=32)
+    if (out.bits!=8 && out.bits!=16 && out.bits!=32)
         return -3;
 
     return 0;
 }
 
-int CheckRecordParams()
+int AudioDemo::CheckRecordParams(const PcmParams& in)
 {
-    if (gInDevice<AUDIO_SOURCE_DEFAULT || gInDevice>AUDIO_SOURCE_CNT)
+    if (mInDevice<AUDIO_SOURCE_DEFAULT || mInDevice>AUDIO_SOURCE_CNT)
         return -1;
 
-    if (gInChannelNum!=1 && gInChannelNum!=2)
+    if (in.channels!=1 && in.channels!=2)
         return -2;
 
-    if (gInBits!=8 && gInBits!=16 && gInBits!=32)
+    if (in.bits!=8 && in.bits!=16 && in.bits!=32)
         return -3;
 
     return 0;
 }
 
-sp<AudioTrack> allocAudioTrack(void)
+sp<AudioTrack> AudioDemo::allocAudioTrack(const PcmParams& out)
 {
-    if (gOutChannelNum < 0) gOutChannelNum = CHANNEL_NUM;
-    if (gOutSampleRate < 0) gOutSampleRate = SAMPLE_RATE;
-    if (gOutBits < 0) gOutBits = SAMPLE_BITS;
-
-    if (CheckPlaybackParams() != 0) {
+    if (CheckPlaybackParams(out) != 0) {
         printf("Invalid playback params!\n");
         return NULL;
     }
 
-    int sampleRate = gOutSampleRate;
+    int sampleRate = out.sampleRate;
     size_t frameCount = 0;
-    int channel = (gOutChannelNum<=1)?AUDIO_CHANNEL_OUT_MONO:AUDIO_CHANNEL_OUT_STEREO;
+    int channel = (out.channels<=1)?AUDIO_CHANNEL_OUT_MONO:AUDIO_CHANNEL_OUT_STEREO;
     audio_format_t aFormat = AUDIO_FORMAT_PCM_16_BIT;
 
-    switch(gOutBits) {
+    switch(out.bits) {
     case 8:
         aFormat = AUDIO_FORMAT_PCM_8_BIT;
         break;
@@ -118,15 +259,15 @@ sp<AudioTrack> allocAudioTrack(void)
         break;
     }
 
-    if (AudioTrack::getMinFrameCount(&frameCount, gOutDevice, sampleRate) != NO_ERROR) {
+    if (AudioTrack::getMinFrameCount(&frameCount, mOutDevice, sampleRate) != NO_ERROR) {
         fprintf(stderr, "cannot compute frame count\n");
         return NULL;
     }
     printf("for stream(%d): rate %d, channel %d, bits %d, frameCount %zu\n",
-            gOutDevice, sampleRate, gOutChannelNum, gOutBits, frameCount);
+            mOutDevice, sampleRate, out.channels, out.bits, frameCount);
 
     sp<AudioTrack> track = new AudioTrack();
-    if (track->set(gOutDevice, sampleRate, aFormat,
+    if (track->set(mOutDevice, sampleRate, aFormat,
             channel, frameCount, AUDIO_OUTPUT_FLAG_NONE, NULL,
             NULL, 0, 0, false, AUDIO_SESSION_ALLOCATE,
             AudioTrack::TRANSFER_OBTAIN) != NO_ERROR) {
@@ -138,23 +279,19 @@ sp<AudioTrack> allocAudioTrack(void)
     return track;
 }
 
-sp<AudioRecord> allocAudioRecord(void)
+sp<AudioRecord> AudioDemo::allocAudioRecord(const PcmParams& in)
 {
-    if (gInChannelNum < 0) gInChannelNum = CHANNEL_NUM;
-    if (gInSampleRate < 0) gInSampleRate = SAMPLE_RATE;
-    if (gInBits < 0) gInBits = SAMPLE_BITS;
-
-    if (CheckRecordParams() != 0) {
+    if (CheckRecordParams(in) != 0) {
         printf("Invalid record params!\n");
         return NULL;
     }
 
-    int sampleRate = gInSampleRate;
+    int sampleRate = in.sampleRate;
     size_t frameCount = 0;
     audio_format_t aFormat = AUDIO_FORMAT_PCM_16_BIT;
-    int channel = (gInChannelNum<=1)?AUDIO_CHANNEL_IN_MONO:AUDIO_CHANNEL_IN_STEREO;
+    int channel = (in.channels<=1)?AUDIO_CHANNEL_IN_MONO:AUDIO_CHANNEL_IN_STEREO;
 
-    switch(gInBits) {
+    switch(in.bits) {
     case 8:
         aFormat = AUDIO_FORMAT_PCM_8_BIT;
         break;
@@ -172,10 +309,10 @@ sp<AudioRecord> allocAudioRecord(void)
         return NULL;
     }
     printf("for source(%d): rate %d, channel %d, bits %d, frameCount %zu\n",
-            gInDevice, sampleRate, gInChannelNum, gInBits, frameCount);
+            mInDevice, sampleRate, in.channels, in.bits, frameCount);
 
     sp<AudioRecord> record = new AudioRecord(String16("AudioDemo"));
-    if (record->set(gInDevice, sampleRate, aFormat,
+    if (record->set(mInDevice, sampleRate, aFormat,
             channel, frameCount, NULL, NULL, 0, false,
             AUDIO_SESSION_ALLOCATE, AudioRecord::TRANSFER_OBTAIN) != NO_ERROR) {
         fprintf(stderr, "cannot initialize audio device\n");
@@ -186,11 +323,32 @@ sp<AudioRecord> allocAudioRecord(void)
     return record;
 }
 
-int ParseWav(FILE* fp)
+typedef struct WAV_INFO{
+    int     channels;
+    int     sample_rate;
+    int     bits;
+    off64_t data_offset;    // first payload byte
+    int64_t data_size;      // payload bytes, to end of file if unknown
+}WAV_INFO;
+
+/*
+ * Walk the RIFF chunks up to "data", skipping any chunk that is not
+ * "fmt ". On success fp is left at the first payload byte.
+ */
+int ReadWavInfo(FILE* fp, WAV_INFO* info)
 {
-    typedef struct WAVE_FMT{
-        char  fccID[4];
+    typedef struct RIFF_HEADER{
+        char fccID[4];
+        unsigned int size;
+        char fccType[4];
+    }RIFF_HEADER;
+
+    typedef struct CHUNK_HEADER{
+        char fccID[4];
         unsigned int size;
+    }CHUNK_HEADER;
+
+    typedef struct WAVE_FMT{
         unsigned short format_tag;
         unsigned short channels;
         unsigned int sample_rate;
@@ -199,53 +357,271 @@ int ParseWav(FILE* fp)
         unsigned short bits_per_sample;
     }WAVE_FMT;
 
-    typedef struct WAVE_DATA{
-        char fccID[4];
-        unsigned int size;
-    }WAVE_DATA;
+    RIFF_HEADER riff;
+    if (fread(&riff, 1, sizeof(riff), fp) != sizeof(riff)) {
+        return -1;
+    }
+    if (strncasecmp(riff.fccID, "RIFF", 4) != 0 || strncasecmp(riff.fccType, "WAVE", 4) != 0) {
+        printf("invalid fcc %.4s %.4s\n", riff.fccID, riff.fccType);
+        return -1;
+    }
 
-    typedef struct WAVE_HEADER{
-        char fccID[4];
-        unsigned int size;
-        char fccType[4];
-        WAVE_FMT fmt_header;
-        WAVE_DATA data_header;
-    }WAVE_HEADER;
+    bool hasFmt = false;
+    CHUNK_HEADER chunk;
+    while (fread(&chunk, 1, sizeof(chunk), fp) == sizeof(chunk)) {
+        if (strncasecmp(chunk.fccID, "fmt ", 4) == 0) {
+            WAVE_FMT fmt;
+            if (chunk.size < sizeof(fmt) || fread(&fmt, 1, sizeof(fmt), fp) != sizeof(fmt)) {
+                return -1;
+            }
+            if (fmt.format_tag != 1) { // not PCM
+                return -2;
+            }
+            info->channels = fmt.channels;
+            info->sample_rate = fmt.sample_rate;
+            info->bits = fmt.bits_per_sample;
+            hasFmt = true;
+            chunk.size -= sizeof(fmt);
+        } else if (strncasecmp(chunk.fccID, "data", 4) == 0) {
+            if (!hasFmt) {
+                return -1;
+            }
+            info->data_offset = ftello64(fp);
+            struct stat64 st;
+            int64_t remain = 0;
+            if (fstat64(fileno(fp), &st) == 0 && st.st_size > info->data_offset)
+                remain = st.st_size - info->data_offset;
+            info->data_size = chunk.size;
+            if (chunk.size == 0 || chunk.size == 0xFFFFFFFF || info->data_size > remain)
+                info->data_size = remain;
+            return 0;
+        }
+        // chunks are word aligned
+        if (fseeko64(fp, (off64_t)chunk.size + (chunk.size & 1), SEEK_CUR) != 0) {
+            return -1;
+        }
+    }
 
-    WAVE_HEADER wav_header;
-    size_t readCount = fread(&wav_header, 1, sizeof(WAVE_HEADER), fp);
-    if (readCount != sizeof(WAVE_HEADER)) {
-        return -1;
+    return -1;
+}
+
+int AudioDemo::ParseWav(FILE* fp, PcmParams* in, int64_t* dataSize)
+{
+    WAV_INFO info;
+    int ret = ReadWavInfo(fp, &info);
+    if (ret < 0) {
+        return ret;
     }
+    *dataSize = info.data_size;
+    in->channels = info.channels;
+    in->sampleRate = info.sample_rate;
+    in->bits = info.bits;
 
-    if (strncasecmp(wav_header.fccID, "RIFF", 4) != 0 || strncasecmp(wav_header.fccType, "WAVE", 4) != 0) {
-        printf("invalid fcc %s %s\n", wav_header.fccID, wav_header.fccType);
-        return -1;
+    printf("WAV file: channels=%d, rate=%d, bits=%d\n", in->channels, in->sampleRate, in->bits);
+
+    return 0;
+}
+
+/************************************************************
+*
+*    Record index
+*
+*    Record() writes a sidecar <out>.idx next to the sample
+*    stream: one INDEX_HEADER followed by one INDEX_ENTRY per
+*    captured block, so a position in a long capture can be
+*    found by time or frame without scanning the payload.
+*
+************************************************************/
+
+#define         INDEX_MAGIC         0x58444941  // "AIDX"
+#define         INDEX_VERSION       1
+#define         INDEX_SUFFIX        ".idx"
+
+#define         INDEX_FLAG_OVERRUN  0x1     // frames were lost before this block
+#define         INDEX_FLAG_SHORT    0x2     // block shorter than requested
+
+typedef struct INDEX_HEADER{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint16_t bits;
+}INDEX_HEADER;
+
+typedef struct INDEX_ENTRY{
+    uint64_t frame;     // first frame of the block in the payload
+    int64_t  time_ns;   // CLOCK_MONOTONIC capture time of that frame
+    uint32_t flags;
+    uint32_t lost;      // frames dropped by overrun before this block
+}INDEX_ENTRY;
+
+FILE* AudioDemo::CreateIndex(const char* file, const PcmParams& in)
+{
+    char path[sizeof(mOutFile) + sizeof(INDEX_SUFFIX)];
+    snprintf(path, sizeof(path), "%s" INDEX_SUFFIX, file);
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Failed to create index: %s\n", path);
+        return NULL;
     }
-    if (wav_header.fmt_header.format_tag != 1) { // not PCM
-        return -2;
+
+    INDEX_HEADER header;
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.sample_rate = in.sampleRate;
+    header.channels = in.channels;
+    header.bits = in.bits;
+    if (fwrite(&header, sizeof(header), 1, fp) != 1) {
+        fprintf(stderr, "Failed to write index: %s\n", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+/*
+ * Translate --seek / --seek-frame into a payload frame for the given file.
+ * With a sidecar index, a time is located by binary search over the block
+ * timestamps, so gaps left by overruns are honoured; without one the
+ * nominal sample rate is used.
+ */
+int64_t AudioDemo::ResolveSeekFrame(const char* file, int sampleRate)
+{
+    if (mSeekMs < 0 && mSeekFrame < 0)
+        return 0;
+
+    char path[sizeof(mInFile) + sizeof(INDEX_SUFFIX)];
+    snprintf(path, sizeof(path), "%s" INDEX_SUFFIX, file);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(INDEX_HEADER) + sizeof(INDEX_ENTRY)) {
+        if (fd >= 0) close(fd);
+        if (mSeekMs >= 0)
+            return mSeekMs*sampleRate/1000;
+        return mSeekFrame;
+    }
+
+    size_t mapSize = st.st_size;
+    void* map = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map index: %s\n", path);
+        return mSeekMs >= 0 ? mSeekMs*sampleRate/1000 : mSeekFrame;
+    }
+
+    const INDEX_HEADER* header = (const INDEX_HEADER*)map;
+    const INDEX_ENTRY* entry = (const INDEX_ENTRY*)(header + 1);
+    size_t count = (mapSize - sizeof(INDEX_HEADER))/sizeof(INDEX_ENTRY);
+    if (header->magic != INDEX_MAGIC || header->version != INDEX_VERSION) {
+        fprintf(stderr, "Invalid index: %s\n", path);
+        munmap(map, mapSize);
+        return mSeekMs >= 0 ? mSeekMs*sampleRate/1000 : mSeekFrame;
     }
-    gInChannelNum = wav_header.fmt_header.channels;
-    gInSampleRate = wav_header.fmt_header.sample_rate;
-    gInBits = wav_header.fmt_header.bits_per_sample;
+    if (header->sample_rate > 0)
+        sampleRate = header->sample_rate;
+
+    // find the last block starting at or before the target
+    size_t lo = 0, hi = count;
+    int64_t target = mSeekMs >= 0 ? entry[0].time_ns + mSeekMs*1000000LL : mSeekFrame;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo)/2;
+        int64_t key = mSeekMs >= 0 ? entry[mid].time_ns : (int64_t)entry[mid].frame;
+        if (key <= target)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    size_t i = lo > 0 ? lo - 1 : 0;
+
+    int64_t frame;
+    if (mSeekMs >= 0) {
+        frame = entry[i].frame + (target - entry[i].time_ns)*sampleRate/1000000000LL;
+        // a time inside an overrun gap starts at the next captured block
+        if (i + 1 < count && frame > (int64_t)entry[i + 1].frame)
+            frame = entry[i + 1].frame;
+    } else {
+        frame = mSeekFrame;
+    }
+    if (frame < 0)
+        frame = 0;
+
+    printf("index: seek to frame %" PRId64 ", block %zu/%zu captured at %" PRId64 " ms%s\n",
+            frame, i, count, (entry[i].time_ns - entry[0].time_ns)/1000000,
+            (entry[i].flags & INDEX_FLAG_OVERRUN) ? " (after overrun)" : "");
+
+    munmap(map, mapSize);
+    return frame;
+}
+
+int AudioDemo::SeekAudio(FILE* fp, const char* file, int sampleRate, int frameSize)
+{
+    int64_t frame = ResolveSeekFrame(file, sampleRate);
+    if (frame <= 0)
+        return 0;
 
-    printf("WAV file: channels=%d, rate=%d, bits=%d\n", gInChannelNum, gInSampleRate, gInBits);
+    if (fseeko64(fp, (off64_t)frame*frameSize, SEEK_CUR) != 0) {
+        fprintf(stderr, "cannot seek to frame %" PRId64 "\n", frame);
+        return -1;
+    }
 
     return 0;
 }
 
-int readAudio(sp<AudioRecord> record, char* data, int sampleCount, int frameSize)
+/************************************************************
+*
+*    PCM transfer kernels
+*
+*    Everything between obtainBuffer() and the file is
+*    instantiated per PcmFormat, so frame sizes and channel
+*    loops are compile-time constants. PCM_DISPATCH picks the
+*    instantiation once, before a loop starts.
+*
+************************************************************/
+
+template <typename T, int CHANNELS>
+struct PcmFormat {
+    typedef T Sample;
+    static const int kChannels = CHANNELS;
+    static const int kFrameSize = sizeof(T)*CHANNELS;
+};
+
+#define PCM_DISPATCH(ret, bits, channels, loop, ...)                               \
+    switch ((bits)*10 + (channels)) {                                               \
+    case 81:  ret = loop<PcmFormat<uint8_t, 1> >(__VA_ARGS__); break;              \
+    case 82:  ret = loop<PcmFormat<uint8_t, 2> >(__VA_ARGS__); break;              \
+    case 161: ret = loop<PcmFormat<int16_t, 1> >(__VA_ARGS__); break;              \
+    case 162: ret = loop<PcmFormat<int16_t, 2> >(__VA_ARGS__); break;              \
+    case 321: ret = loop<PcmFormat<int32_t, 1> >(__VA_ARGS__); break;              \
+    case 322: ret = loop<PcmFormat<int32_t, 2> >(__VA_ARGS__); break;              \
+    default:                                                                        \
+        fprintf(stderr, "unsupported format: bits %d, channels %d\n", bits, channels); \
+        ret = -1;                                                                   \
+        break;                                                                      \
+    }
+
+template <typename F>
+static int readAudio(const sp<AudioRecord>& record, typename F::Sample* data, int frameCount)
 {
-    int toRead = sampleCount;
+    int toRead = frameCount;
 
-    printf("read sample count %d\n", sampleCount);
+    printf("read sample count %d\n", frameCount);
     while (toRead > 0) {
         AudioRecord::Buffer buffer;
         buffer.frameCount = toRead;
-        status_t status = record->obtainBuffer(&buffer, 1);
+        status_t status;
+        {
+            TRACE_SCOPE("record.obtainBuffer");
+            status = record->obtainBuffer(&buffer, 1);
+        }
         if (status == NO_ERROR) {
-            int offset = sampleCount - toRead;
-            memcpy(&data[offset*frameSize], buffer.i8, buffer.size);
+            int offset = frameCount - toRead;
+            {
+                TRACE_SCOPE("record.memcpy");
+                memcpy(data + offset*F::kChannels, buffer.raw, buffer.frameCount*F::kFrameSize);
+            }
             toRead -= buffer.frameCount;
             record->releaseBuffer(&buffer);
         } else if (status != TIMED_OUT && status != WOULD_BLOCK) {
@@ -254,21 +630,31 @@ int readAudio(sp<AudioRecord> record, char* data, int sampleCount, int frameSize
         }
     }
 
-    return sampleCount-toRead;
+    return frameCount-toRead;
 }
 
-int witreAudio(sp<AudioTrack> track, char* data, int sampleCount, int frameSize)
+template <typename F>
+static int writeAudio(const sp<AudioTrack>& track, const typename F::Sample* data, int frameCount,
+        bool verbose)
 {
-    int toWrite = sampleCount;
+    int toWrite = frameCount;
 
-    printf("write sample count %d\n", sampleCount);
+    if (verbose)
+        printf("write sample count %d\n", frameCount);
     while (toWrite > 0) {
         AudioTrack::Buffer buffer;
         buffer.frameCount = toWrite;
-        status_t status = track->obtainBuffer(&buffer, 1);
+        status_t status;
+        {
+            TRACE_SCOPE("track.obtainBuffer");
+            status = track->obtainBuffer(&buffer, 1);
+        }
         if (status == NO_ERROR) {
-            int offset = sampleCount - toWrite;
-            memcpy(buffer.i8, &data[offset*frameSize], buffer.size);
+            int offset = frameCount - toWrite;
+            {
+                TRACE_SCOPE("track.memcpy");
+                memcpy(buffer.raw, data + offset*F::kChannels, buffer.frameCount*F::kFrameSize);
+            }
             toWrite -= buffer.frameCount;
             track->releaseBuffer(&buffer);
         } else if (status != TIMED_OUT && status != WOULD_BLOCK) {
@@ -280,47 +666,103 @@ int witreAudio(sp<AudioTrack> track, char* data, int sampleCount, int frameSize)
     return toWrite;
 }
 
-int RecordAndPlayback() {
-    sp<AudioRecord> record = allocAudioRecord();
+#ifdef RAMP_VOLUME
+template <typename T>
+static inline T scaleSample(T sample, float volume)
+{
+    return (T)(volume*sample);
+}
+
+// 8-bit PCM is unsigned, silence is 128
+template <>
+inline uint8_t scaleSample<uint8_t>(uint8_t sample, float volume)
+{
+    return (uint8_t)(128 + volume*((int)sample - 128));
+}
+
+template <typename F>
+static void rampVolume(typename F::Sample* data, int frameCount, bool up)
+{
+    printf("ramp volume %d\n", frameCount);
+    if (frameCount <= 0)
+        return;
+
+    float vl = up?0.0f:1.0f;
+    const float vlInc = (up?1.0f:-1.0f)/frameCount;
+
+    for (int i = 0; i < frameCount; i++) {
+        for (int ch = 0; ch < F::kChannels; ch++)
+            data[ch] = scaleSample(data[ch], vl);
+        data += F::kChannels;
+        vl += vlInc;
+    }
+}
+#endif
+
+template <typename F>
+int AudioDemo::duplexLoop(const sp<AudioRecord>& record, const sp<AudioTrack>& track, const PcmParams& in)
+{
+    int frameCount = in.sampleRate/10;
+    typename F::Sample* buffer = new typename F::Sample[frameCount*F::kChannels];
+
+    while (mRecording && mPlaying) {
+        TRACE_SCOPE("RecordAndPlayback");
+        int readCount = readAudio<F>(record, buffer, frameCount);
+        writeAudio<F>(track, buffer, readCount, true);
+    }
+
+    delete []buffer;
+    return 0;
+}
+
+int AudioDemo::RecordAndPlayback() {
+    PcmParams in = resolveParams(mInChannelNum, mInSampleRate, mInBits, kDefaultParams);
+    PcmParams out = resolveParams(mOutChannelNum, mOutSampleRate, mOutBits, in);
+
+    // samples are passed through untouched, so both ends share one format
+    if (out.channels != in.channels || out.bits != in.bits) {
+        printf("Output channels and bits must match the input!\n");
+        return -1;
+    }
+
+    sp<AudioRecord> record = allocAudioRecord(in);
     if (record == NULL) {
         printf("Setup audio record fail!\n");
         return -1;
     }
 
     printf("start recording.\n");
-    isRecording = true;
+    mRecording = true;
     if (record->start() != NO_ERROR) {
         fprintf(stderr, "record start failed, now exiting\n");
+        mRecording = false;
         return -1;
     }
     int32_t one;
     record->read(&one, sizeof(one));
 
-    sp<AudioTrack> track = allocAudioTrack();
+    sp<AudioTrack> track = allocAudioTrack(out);
     if(track == NULL) {
         printf("Setup audio track fail!\n");
+        record->stop();
+        mRecording = false;
         return -1;
     }
 
     printf("start playing.\n");
-    isPlaying = true;
+    mPlaying = true;
     if (track->start() != NO_ERROR) {
         fprintf(stderr, "playback start failed, now exiting\n");
         record->stop();
+        mPlaying = false;
+        mRecording = false;
         return -1;
     }
 
-    int inSampleCount = gInSampleRate/10;
-    int inFrameSize = gInChannelNum*gInBits/8;
-    int outFrameSize = gOutChannelNum*gOutBits/8;
-
-    char* input = new char[inFrameSize*inSampleCount];
-    while (isRecording && isPlaying) {
-        int readCount = readAudio(record, input, inSampleCount, inFrameSize);
-        int wirteCount = (readCount*inFrameSize)/outFrameSize;
-        witreAudio(track, input, wirteCount, outFrameSize);
-    }
-    delete []input;
+    int ret;
+    PCM_DISPATCH(ret, in.bits, in.channels, duplexLoop, record, track, in);
+    mPlaying = false;
+    mRecording = false;
 
     printf("playback stop\n");
     track->stop();
@@ -328,96 +770,291 @@ int RecordAndPlayback() {
     printf("record stop\n");
     record->stop();
 
-    delete []input;
+    return ret;
+}
 
+template <typename F>
+int AudioDemo::recordLoop(const sp<AudioRecord>& record, const PcmParams& in, FILE* fp, FILE* idx)
+{
+    int frameCount = in.sampleRate/10;
+    typename F::Sample* buffer = new typename F::Sample[frameCount*F::kChannels];
+    uint64_t framePos = 0;
+
+    while (mRecording) {
+        TRACE_SCOPE("Record");
+        int readCount = readAudio<F>(record, buffer, frameCount);
+        nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+        {
+            TRACE_SCOPE("fwrite");
+            fwrite(buffer, F::kFrameSize, readCount, fp);
+            fflush(fp);
+        }
+        printf("write sample count %d\n", readCount);
+
+        if (idx != NULL && readCount > 0) {
+            INDEX_ENTRY entry;
+            entry.frame = framePos;
+            entry.time_ns = now - (nsecs_t)readCount*1000000000LL/in.sampleRate;
+            entry.lost = record->getInputFramesLost();
+            entry.flags = 0;
+            if (entry.lost > 0) entry.flags |= INDEX_FLAG_OVERRUN;
+            if (readCount < frameCount) entry.flags |= INDEX_FLAG_SHORT;
+            fwrite(&entry, sizeof(entry), 1, idx);
+            fflush(idx);
+        }
+        framePos += readCount;
+    }
+
+    delete []buffer;
     return 0;
 }
 
-int Record() {
-    sp<AudioRecord> record = allocAudioRecord();
+int AudioDemo::Record() {
+    PcmParams in = resolveParams(mInChannelNum, mInSampleRate, mInBits, kDefaultParams);
+    sp<AudioRecord> record = allocAudioRecord(in);
     if (record == NULL) {
         printf("Setup audio record fail!\n");
         return -1;
     }
 
     FILE *fp = NULL;
-    fp = fopen(gOutFile, "wb");
+    fp = fopen(mOutFile, "wb");
     if (fp == NULL) {
-        fprintf(stderr, "Failed to create file: %s\n", gOutFile);
+        fprintf(stderr, "Failed to create file: %s\n", mOutFile);
         return -1;
     }
 
+    FILE *idx = CreateIndex(mOutFile, in);
+
     printf("start record");
-    isRecording = true;
+    mRecording = true;
     if (record->start() != NO_ERROR) {
         fprintf(stderr, "record start failed, now exiting\n");
+        mRecording = false;
+        if (idx != NULL) fclose(idx);
         fclose(fp);
         return -1;
     }
     int32_t one;
     record->read(&one, sizeof(one));
+    record->getInputFramesLost();
 
-    int sampleCount = gInSampleRate/10;
-    int frameSize = gInChannelNum*gInBits/8;
-    char* buffer = new char[frameSize*sampleCount];
-    while (isRecording) {
-        int readCount = readAudio(record, buffer, sampleCount, frameSize);
-        fwrite(buffer, frameSize, readCount, fp);
-        printf("write sample count %d\n", readCount);
-        fflush(fp);
-    }
+    int ret;
+    PCM_DISPATCH(ret, in.bits, in.channels, recordLoop, record, in, fp, idx);
+    mRecording = false;
 
     printf("record stop\n");
     record->stop();
-    delete []buffer;
+    if (idx != NULL) fclose(idx);
     fclose(fp);
 
-    return 0;
+    return ret;
 }
 
-#ifdef RAMP_VOLUME
-void rampVolume(int16_t* data, int frameCount, bool up)
+/************************************************************
+*
+*    Soak statistics
+*
+*    Rolling counters for long playback runs, printed every
+*    --report seconds. Only running totals are kept, so memory
+*    stays constant however long the run is.
+*
+************************************************************/
+
+#define         SOAK_REPORT_SEC     60
+
+typedef struct SOAK_STATS{
+    nsecs_t     start;
+    nsecs_t     windowStart;
+    nsecs_t     cpuWindowStart;
+    uint64_t    frames;             // frames handed to the track
+    uint64_t    windowFrames;
+    uint32_t    underrunFrames;     // last getUnderrunFrames()
+    uint32_t    xruns;
+    uint32_t    windowXruns;
+    uint32_t    loops;
+    uint32_t    lastPosition;       // last AudioTimestamp::mPosition, wraps
+    uint64_t    position;           // presented frames, extended across wraps
+    int         sampleRate;
+    int         reportSec;
+    bool        hasPosition;
+    bool        hasBaseLatency;
+    double      baseLatencyMs;
+    double      latencyMs;
+}SOAK_STATS;
+
+static nsecs_t cpuTime(void)
 {
-    printf("ramp volume %d\n", frameCount);
-    int16_t *in = data;
-    int16_t* out = data;
-    float vl = up?0.0f:1.0f;
-    const float vlInc = (up?1.0f:-1.0f)/frameCount;
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return (nsecs_t)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
 
-    do {
-        float a = vl*(float)*in;
-        *out++ = (int16_t)a;
-        *out++ = (int16_t)a;
-        in += 2;
-        vl += vlInc;
-    } while (--frameCount);
+static void soakInit(SOAK_STATS* stats, const sp<AudioTrack>& track, int sampleRate, int reportSec)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->sampleRate = sampleRate;
+    stats->reportSec = reportSec;
+    stats->start = stats->windowStart = systemTime(SYSTEM_TIME_MONOTONIC);
+    stats->cpuWindowStart = cpuTime();
+    stats->underrunFrames = track->getUnderrunFrames();
 }
+
+static void soakReport(SOAK_STATS* stats, nsecs_t now, bool final)
+{
+    double windowSec = (now - stats->windowStart)/1000000000.0;
+    double audioSec = (double)stats->windowFrames/stats->sampleRate;
+    double cpuMs = (cpuTime() - stats->cpuWindowStart)/1000000.0;
+
+    printf("soak%s: %" PRId64 "s, loops %u, xruns %u (%.1f/h, total %u), "
+            "latency %.1f ms (drift %+.1f ms), cpu %.2f ms/s\n",
+            final ? " done" : "", (int64_t)((now - stats->start)/1000000000LL),
+            stats->loops, stats->windowXruns,
+            windowSec > 0 ? stats->windowXruns*3600.0/windowSec : 0.0, stats->xruns,
+            stats->latencyMs, stats->hasBaseLatency ? stats->latencyMs - stats->baseLatencyMs : 0.0,
+            audioSec > 0 ? cpuMs/audioSec : 0.0);
+    fflush(stdout);
+
+    stats->windowStart = now;
+    stats->cpuWindowStart = cpuTime();
+    stats->windowFrames = 0;
+    stats->windowXruns = 0;
+}
+
+static void soakUpdate(SOAK_STATS* stats, const sp<AudioTrack>& track, size_t frames)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    stats->frames += frames;
+    stats->windowFrames += frames;
+
+    // each poll that sees new underrun frames counts as one xrun
+    uint32_t underrun = track->getUnderrunFrames();
+    if (underrun != stats->underrunFrames) {
+        stats->underrunFrames = underrun;
+        stats->xruns++;
+        stats->windowXruns++;
+    }
+
+    // written but not yet presented, extrapolated to now
+    AudioTimestamp ts;
+    if (track->getTimestamp(ts) == NO_ERROR) {
+        // mPosition wraps after 2^32 frames (~27h at 44.1k); the unsigned
+        // delta between polls stays correct across the wrap
+        if (stats->hasPosition)
+            stats->position += (uint32_t)(ts.mPosition - stats->lastPosition);
+        else
+            stats->position = ts.mPosition;
+        stats->lastPosition = ts.mPosition;
+        stats->hasPosition = true;
+
+        nsecs_t tsTime = (nsecs_t)ts.mTime.tv_sec*1000000000LL + ts.mTime.tv_nsec;
+        double presented = stats->position + (double)(now - tsTime)*stats->sampleRate/1000000000.0;
+        stats->latencyMs = ((double)stats->frames - presented)*1000.0/stats->sampleRate;
+        if (!stats->hasBaseLatency) {
+            stats->hasBaseLatency = true;
+            stats->baseLatencyMs = stats->latencyMs;
+        }
+    }
+
+    if (now - stats->windowStart >= (nsecs_t)stats->reportSec*1000000000LL)
+        soakReport(stats, now, false);
+}
+
+template <typename F>
+int AudioDemo::playbackLoop(FILE* fp, const sp<AudioTrack>& track, const PcmParams& in,
+        const PcmParams& out, off64_t loopStart, off64_t dataEnd)
+{
+    const size_t frameCount = in.sampleRate/10;
+    typename F::Sample* buffer = new typename F::Sample[frameCount*F::kChannels];
+    off64_t pos = loopStart;
+
+    SOAK_STATS stats;
+    int reportSec = mReportSec;
+    if (mLoop && reportSec < 0) reportSec = SOAK_REPORT_SEC;
+    soakInit(&stats, track, out.sampleRate, reportSec);
+
+#ifdef RAMP_VOLUME
+    int isFirst = 1;
+#endif
+    bool eof = false;
+    while (!eof && mPlaying) {
+        TRACE_SCOPE("Playback");
+        size_t readCount = 0;
+        {
+            TRACE_SCOPE("fread");
+            // wrap inside the block so the seam is sample accurate
+            while (readCount < frameCount) {
+                size_t want = frameCount - readCount;
+                if (pos >= dataEnd)
+                    want = 0;
+                else if ((off64_t)want*F::kFrameSize > dataEnd - pos)
+                    want = (dataEnd - pos)/F::kFrameSize;
+                size_t n = want > 0 ? fread(buffer + readCount*F::kChannels, F::kFrameSize, want, fp) : 0;
+                readCount += n;
+                pos += (off64_t)n*F::kFrameSize;
+                if (n < want) {
+                    eof = true;
+                    break;
+                }
+                if (readCount == frameCount)
+                    break;
+                if (!mLoop || dataEnd - loopStart < F::kFrameSize || fseeko64(fp, loopStart, SEEK_SET) != 0) {
+                    eof = true;
+                    break;
+                }
+                pos = loopStart;
+                stats.loops++;
+            }
+        }
+        if (!mLoop)
+            printf("read sample count %zu\n", readCount);
+#ifdef RAMP_VOLUME
+        if (isFirst) {
+            isFirst = 0;
+            rampVolume<F>(buffer, readCount, true);
+        }
 #endif
+        int remain = writeAudio<F>(track, buffer, readCount, !mLoop);
+        if (reportSec > 0)
+            soakUpdate(&stats, track, readCount - remain);
+    }
+    if (reportSec > 0)
+        soakReport(&stats, systemTime(SYSTEM_TIME_MONOTONIC), true);
+
+    delete []buffer;
+    return 0;
+}
 
-int Playback() {
+int AudioDemo::Playback() {
     FILE *fp = NULL;
-    fp = fopen(gInFile, "rb");
+    fp = fopen(mInFile, "rb");
     if (fp == NULL) {
-        fprintf(stderr, "Failed to open file: %s\n", gInFile);
+        fprintf(stderr, "Failed to open file: %s\n", mInFile);
         return -1;
     }
-    if (strstr(gInFile, ".wav")) {
-        if (ParseWav(fp) < 0) {
+    int64_t dataSize = -1;
+    PcmParams in;
+    if (strstr(mInFile, ".wav")) {
+        if (ParseWav(fp, &in, &dataSize) < 0) {
             fprintf(stderr, "Invalid wav file!\n");
             fclose(fp);
             return -1;
         }
-        if (gOutChannelNum < 0) gOutChannelNum = gInChannelNum;
-        if (gOutSampleRate < 0) gOutSampleRate = gInSampleRate;
-        if (gOutBits < 0) gOutBits = gInBits;
     } else {
-        if (gInChannelNum < 0) gInChannelNum = CHANNEL_NUM;
-        if (gInSampleRate < 0) gInSampleRate = SAMPLE_RATE;
-        if (gInBits < 0) gInBits = SAMPLE_BITS;
-        printf("PCM file: channels=%d, rate=%d, bits=%d\n", gInChannelNum, gInSampleRate, gInBits);
+        in = resolveParams(mInChannelNum, mInSampleRate, mInBits, kDefaultParams);
+        printf("PCM file: channels=%d, rate=%d, bits=%d\n", in.channels, in.sampleRate, in.bits);
+    }
+    PcmParams out = resolveParams(mOutChannelNum, mOutSampleRate, mOutBits, in);
+
+    // samples go to the track untouched, so both ends share one format
+    if (out.channels != in.channels || out.bits != in.bits) {
+        printf("Output channels and bits must match the input!\n");
+        fclose(fp);
+        return -1;
     }
 
-    sp<AudioTrack> track = allocAudioTrack();
+    sp<AudioTrack> track = allocAudioTrack(out);
     if(track == NULL) {
         printf("Setup audio track fail!\n");
         fclose(fp);
@@ -427,30 +1064,34 @@ int Playback() {
     printf("start playing.\n");
 //    printf("setVolume 0\n");
 //    track->setVolume(0.0f);
-    isPlaying = true;
+    mPlaying = true;
     if (track->start() != NO_ERROR) {
         fprintf(stderr, "playback start failed, now exiting\n");
+        mPlaying = false;
         fclose(fp);
         return -1;
     }
 //    nsecs_t start_tm = systemTime();
-    int sampleCount = gInSampleRate/10;
-    int frameSize = gInChannelNum*gInBits/8;
-    char* buffer = new char[frameSize*sampleCount];
-#ifdef RAMP_VOLUME
-    int isFirst = 1;
-#endif
-    while (!feof(fp) && isPlaying) {
-        size_t readCount = fread(buffer, frameSize, sampleCount, fp);
-        printf("read sample count %zu\n", readCount);
-#ifdef RAMP_VOLUME
-        if (isFirst) {
-            isFirst = 0;
-            rampVolume((int16_t*)buffer, readCount, true);
-        }
-#endif
-        witreAudio(track, buffer, readCount, frameSize);
+    int frameSize = in.channels*in.bits/8;
+    off64_t dataEnd = ftello64(fp);
+    if (dataSize >= 0) {
+        dataEnd += dataSize;
+    } else {
+        struct stat64 st;
+        if (fstat64(fileno(fp), &st) == 0) dataEnd = st.st_size;
     }
+    if (SeekAudio(fp, mInFile, in.sampleRate, frameSize) != 0) {
+        track->stop();
+        mPlaying = false;
+        fclose(fp);
+        return -1;
+    }
+    // with --loop the range from the seek point to the end of data repeats
+    off64_t loopStart = ftello64(fp);
+
+    int ret;
+    PCM_DISPATCH(ret, in.bits, in.channels, playbackLoop, fp, track, in, out, loopStart, dataEnd);
+    mPlaying = false;
 
 #ifdef RAMP_VOLUME
     printf("setVolume 0\n");
@@ -462,66 +1103,77 @@ int Playback() {
 
     printf("playback stop\n");
     track->stop();
-    delete []buffer;
     fclose(fp);
 
-    return 0;
+    return ret;
 }
 
-int Resample()
+int AudioDemo::Resample()
 {
     int ret;
     struct resampler_itfe *ri;
 
-    if (gInChannelNum < 0) gInChannelNum = CHANNEL_NUM;
-    if (gInSampleRate < 0) gInSampleRate = SAMPLE_RATE;
-    if (gInBits < 0) gInBits = SAMPLE_BITS;
-
-    if (gOutSampleRate < 0) gOutSampleRate = SAMPLE_RATE;
+    PcmParams in = resolveParams(mInChannelNum, mInSampleRate, mInBits, kDefaultParams);
+    int outSampleRate = mOutSampleRate < 0 ? SAMPLE_RATE : mOutSampleRate;
 
-    ret = create_resampler(gInSampleRate, gOutSampleRate, gInChannelNum,
-                            gResample, NULL, &ri);
+    ret = create_resampler(in.sampleRate, outSampleRate, in.channels,
+                            mResample, NULL, &ri);
     printf("resampler rate: %d -> %d, channels=%d, quality=%d\n",
-            gInSampleRate, gOutSampleRate, gInChannelNum, gResample);
+            in.sampleRate, outSampleRate, in.channels, mResample);
     if (ret != 0) {
         fprintf(stderr, "create_resampler fail %d\n", ret);
         return -1;
     }
 
-    FILE* fpin = fopen(gInFile, "rb");
+    FILE* fpin = fopen(mInFile, "rb");
     if (fpin == NULL) {
-        printf("fail open %s\n", gInFile);
+        printf("fail open %s\n", mInFile);
         release_resampler(ri);
         return -1;
     }
-    FILE* fpout = fopen(gOutFile, "wb");
+    FILE* fpout = fopen(mOutFile, "wb");
     if (fpout == NULL) {
-        printf("fail open %s\n", gOutFile);
+        printf("fail open %s\n", mOutFile);
         release_resampler(ri);
         fclose(fpin);
         return -1;
     }
 
-    size_t frame_size = gInChannelNum * (gInBits>>3);
-    int8_t* inbuf = new int8_t[gInSampleRate*frame_size];
-    int8_t* outbuf = new int8_t[gOutSampleRate*frame_size];
+    size_t frame_size = in.channels * (in.bits>>3);
+    if (SeekAudio(fpin, mInFile, in.sampleRate, frame_size) != 0) {
+        release_resampler(ri);
+        fclose(fpin);
+        fclose(fpout);
+        return -1;
+    }
+    int8_t* inbuf = new int8_t[in.sampleRate*frame_size];
+    int8_t* outbuf = new int8_t[outSampleRate*frame_size];
     size_t inFrameCount, outFrameCount;
 
     while (1) {
-        int in_bytes = fread(inbuf, 1, gInSampleRate*frame_size, fpin);
+        TRACE_SCOPE("Resample");
+        int in_bytes;
+        {
+            TRACE_SCOPE("fread");
+            in_bytes = fread(inbuf, 1, in.sampleRate*frame_size, fpin);
+        }
         if (in_bytes <= 0) {
             printf("EOF\n");
             break;
         }
         inFrameCount = in_bytes/frame_size;
-        outFrameCount = inFrameCount*gOutSampleRate/gInSampleRate;
+        outFrameCount = inFrameCount*outSampleRate/in.sampleRate;
 
-        ret = ri->resample_from_input(ri, (int16_t*)inbuf, &inFrameCount, (int16_t*)outbuf, &outFrameCount);
+        {
+            TRACE_SCOPE("resample_from_input");
+            ret = ri->resample_from_input(ri, (int16_t*)inbuf, &inFrameCount, (int16_t*)outbuf, &outFrameCount);
+        }
         printf("resampler: in %zu, out %zu\n", inFrameCount, outFrameCount);
         if (ret < 0) {
             printf("resample failed %d\n", ret);
             break;
         }
+        TRACE_SCOPE("fwrite");
         fwrite(outbuf, 1, outFrameCount*frame_size, fpout);
     }
 
@@ -534,6 +1186,228 @@ int Resample()
     return 0;
 }
 
+/************************************************************
+*
+*    Repack
+*
+*    Wrap raw PCM in a WAV header, strip a header, cut a frame
+*    range (--seek/--seek-frame, --frames) or append to an
+*    existing file (--append). The payload never leaves the
+*    kernel: copy_file_range(), then sendfile(), with a plain
+*    read/write loop as the last resort.
+*
+************************************************************/
+
+#define         WAV_HEADER_SIZE     44
+#define         COPY_CHUNK_BYTES    (1024*1024)
+
+static bool isWavFile(const char* file)
+{
+    return strstr(file, ".wav") != NULL;
+}
+
+static int writeWavHeader(int fd, const WAV_INFO* info)
+{
+    uint8_t h[WAV_HEADER_SIZE];
+    uint32_t blockAlign = info->channels*info->bits/8;
+    uint32_t byteRate = info->sample_rate*blockAlign;
+    uint32_t dataSize = info->data_size;
+    uint32_t riffSize = dataSize + WAV_HEADER_SIZE - 8;
+    uint32_t fmtSize = 16;
+    uint16_t formatTag = 1;
+    uint16_t channels = info->channels;
+    uint32_t sampleRate = info->sample_rate;
+    uint16_t align = blockAlign;
+    uint16_t bits = info->bits;
+
+    memcpy(h, "RIFF", 4);       memcpy(h + 4, &riffSize, 4);
+    memcpy(h + 8, "WAVE", 4);
+    memcpy(h + 12, "fmt ", 4);  memcpy(h + 16, &fmtSize, 4);
+    memcpy(h + 20, &formatTag, 2);
+    memcpy(h + 22, &channels, 2);
+    memcpy(h + 24, &sampleRate, 4);
+    memcpy(h + 28, &byteRate, 4);
+    memcpy(h + 32, &align, 2);
+    memcpy(h + 34, &bits, 2);
+    memcpy(h + 36, "data", 4);  memcpy(h + 40, &dataSize, 4);
+
+    return write(fd, h, sizeof(h)) == (ssize_t)sizeof(h) ? 0 : -1;
+}
+
+// Copy len bytes from fdin at offset to the current position of fdout.
+static int64_t copyPayload(int fdin, off64_t offset, int fdout, int64_t len)
+{
+    static bool useCopyFileRange = true;
+    static bool useSendfile = true;
+    int64_t remain = len;
+
+    while (remain > 0) {
+        size_t chunk = remain > COPY_CHUNK_BYTES ? COPY_CHUNK_BYTES : remain;
+        ssize_t n = -1;
+
+        TRACE_SCOPE("copyPayload");
+#ifdef __NR_copy_file_range
+        if (useCopyFileRange) {
+            loff_t off = offset;
+            n = syscall(__NR_copy_file_range, fdin, &off, fdout, NULL, chunk, 0);
+            if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                useCopyFileRange = false;
+            }
+        }
+#else
+        useCopyFileRange = false;
+#endif
+        if (!useCopyFileRange && useSendfile) {
+            off64_t off = offset;
+            n = sendfile64(fdout, fdin, &off, chunk);
+            if (n < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                useSendfile = false;
+            }
+        }
+        if (!useCopyFileRange && !useSendfile) {
+            static char buffer[64*1024];
+            n = pread64(fdin, buffer, chunk > sizeof(buffer) ? sizeof(buffer) : chunk, offset);
+            if (n > 0 && write(fdout, buffer, n) != n) {
+                n = -1;
+            }
+        }
+
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (n <= 0) {
+            fprintf(stderr, "copy failed at offset %" PRId64 ": %s\n", (int64_t)offset, strerror(errno));
+            break;
+        }
+        offset += n;
+        remain -= n;
+    }
+
+    return len - remain;
+}
+
+int AudioDemo::Repack()
+{
+    if (strcmp(mInFile, mOutFile) == 0) {
+        printf("Repack: input and output must differ!\n");
+        return -1;
+    }
+
+    FILE* fpin = fopen(mInFile, "rb");
+    if (fpin == NULL) {
+        printf("fail open %s\n", mInFile);
+        return -1;
+    }
+
+    WAV_INFO in;
+    if (isWavFile(mInFile)) {
+        if (ReadWavInfo(fpin, &in) < 0) {
+            fprintf(stderr, "Invalid wav file!\n");
+            fclose(fpin);
+            return -1;
+        }
+    } else {
+        struct stat64 st;
+        PcmParams params = resolveParams(mInChannelNum, mInSampleRate, mInBits, kDefaultParams);
+        in.channels = params.channels;
+        in.sample_rate = params.sampleRate;
+        in.bits = params.bits;
+        in.data_offset = 0;
+        in.data_size = fstat64(fileno(fpin), &st) == 0 ? st.st_size : 0;
+    }
+    int frameSize = in.channels*in.bits/8;
+    if (frameSize <= 0) {
+        printf("Repack: invalid input format!\n");
+        fclose(fpin);
+        return -1;
+    }
+
+    int64_t totalFrames = in.data_size/frameSize;
+    int64_t startFrame = ResolveSeekFrame(mInFile, in.sample_rate);
+    if (startFrame > totalFrames) startFrame = totalFrames;
+    int64_t frames = totalFrames - startFrame;
+    if (mFrameCount >= 0 && mFrameCount < frames) frames = mFrameCount;
+
+    // an existing output is only reopened when appending
+    WAV_INFO out = in;
+    out.data_size = 0;
+    bool outWav = isWavFile(mOutFile);
+    bool appending = false;
+    if (mAppend) {
+        FILE* fpout = fopen(mOutFile, "rb");
+        if (fpout != NULL) {
+            appending = true;
+            if (outWav) {
+                int ret = ReadWavInfo(fpout, &out);
+                struct stat64 st;
+                if (ret < 0 || fstat64(fileno(fpout), &st) != 0
+                        || out.data_offset + out.data_size != st.st_size) {
+                    fprintf(stderr, "cannot append to %s: data is not the last chunk\n", mOutFile);
+                    ret = -1;
+                } else if (out.channels != in.channels || out.sample_rate != in.sample_rate || out.bits != in.bits) {
+                    fprintf(stderr, "cannot append to %s: format mismatch\n", mOutFile);
+                    ret = -1;
+                }
+                if (ret < 0) {
+                    fclose(fpout);
+                    fclose(fpin);
+                    return -1;
+                }
+            }
+            fclose(fpout);
+        }
+    }
+
+    if (outWav && (out.data_size + frames*frameSize) > (int64_t)(0xFFFFFFFFU - WAV_HEADER_SIZE)) {
+        fprintf(stderr, "Repack: payload too large for a wav file\n");
+        fclose(fpin);
+        return -1;
+    }
+
+    int fdout = open(mOutFile, O_WRONLY | O_CREAT | (appending ? 0 : O_TRUNC), 0644);
+    if (fdout < 0) {
+        fprintf(stderr, "Failed to create file: %s\n", mOutFile);
+        fclose(fpin);
+        return -1;
+    }
+
+    printf("Repack: channels=%d, rate=%d, bits=%d, frames %" PRId64 "+%" PRId64 " %s %s\n",
+            in.channels, in.sample_rate, in.bits, startFrame, frames,
+            appending ? "appended to" : "written to", outWav ? "wav" : "pcm");
+
+    int ret = 0;
+    if (outWav && !appending) {
+        out.data_size = frames*frameSize;
+        ret = writeWavHeader(fdout, &out);
+    } else if (lseek64(fdout, 0, SEEK_END) < 0) {
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        int64_t len = frames*frameSize;
+        int64_t copied = copyPayload(fileno(fpin), in.data_offset + startFrame*frameSize, fdout, len);
+        if (copied != len) {
+            ret = -1;
+        } else if (outWav && appending) {
+            // refresh RIFF and data sizes of the extended file
+            uint32_t dataSize = out.data_size + len;
+            uint32_t riffSize = out.data_offset + dataSize - 8;
+            if (pwrite64(fdout, &riffSize, 4, 4) != 4
+                    || pwrite64(fdout, &dataSize, 4, out.data_offset - 4) != 4) {
+                ret = -1;
+            }
+        }
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Repack to %s failed\n", mOutFile);
+    }
+
+    close(fdout);
+    fclose(fpin);
+
+    return ret;
+}
+
 static void createSine(void *vbuffer, size_t frames,
         size_t channels, double sampleRate, double freq)
 {
@@ -550,28 +1424,26 @@ static void createSine(void *vbuffer, size_t frames,
     }
 }
 
-int CreateSineFile()
+int AudioDemo::CreateSineFile()
 {
     int16_t* buffer = NULL;
-    if (gOutChannelNum < 0) gOutChannelNum = CHANNEL_NUM;
-    if (gOutSampleRate < 0) gOutSampleRate = SAMPLE_RATE;
-    if (gOutBits != 16) {
+    PcmParams out = resolveParams(mOutChannelNum, mOutSampleRate, SAMPLE_BITS, kDefaultParams);
+    if (mOutBits != 16) {
         printf("MakeSine: only support 16bits!\n");
-        gOutBits = SAMPLE_BITS;
     }
 
     FILE *fp = NULL;
-    fp = fopen(gOutFile, "wb");
+    fp = fopen(mOutFile, "wb");
     if (fp == NULL) {
-        fprintf(stderr, "Failed to create file: %s\n", gOutFile);
+        fprintf(stderr, "Failed to create file: %s\n", mOutFile);
         return -1;
     }
 
-    buffer = new int16_t[gOutSampleRate*gOutChannelNum];
+    buffer = new int16_t[out.sampleRate*out.channels];
     int i=0;
-    for (i=0; i<gSineTime; i++) {
-        createSine(buffer, gOutSampleRate, gOutChannelNum, gOutSampleRate, gSineFreq);
-        fwrite(buffer, gOutChannelNum*sizeof(int16_t), gOutSampleRate, fp);
+    for (i=0; i<mSineTime; i++) {
+        createSine(buffer, out.sampleRate, out.channels, out.sampleRate, mSineFreq);
+        fwrite(buffer, out.channels*sizeof(int16_t), out.sampleRate, fp);
     }
 
     delete []buffer;
@@ -587,29 +1459,37 @@ int CreateSineFile()
 *    main in name space
 *
 ************************************************************/
-int exectue() {
-    if (gResample >= 0) {
-        if (gInFile[0] == 0 || gOutFile[0] == 0) {
+int AudioDemo::Execute(void)
+{
+    if (mRepack) {
+        if (mInFile[0] == 0 || mOutFile[0] == 0) {
+            printf("Repack: invalid parameter!\n");
+            return -1;
+        }
+        printf("Repack from file %s to file %s\n", mInFile, mOutFile);
+        Repack();
+    } else if (mResample >= 0) {
+        if (mInFile[0] == 0 || mOutFile[0] == 0) {
             printf("Resample: invalid parameter!\n");
             return -1;
         }
-        printf("Resample from file %s to file %s\n", gInFile, gOutFile);
+        printf("Resample from file %s to file %s\n", mInFile, mOutFile);
         Resample();
-    } else if (gSineFreq >= 0) {
-        if (gOutFile[0] == 0) {
+    } else if (mSineFreq >= 0) {
+        if (mOutFile[0] == 0) {
             printf("MakeSine: invalid parameter!\n");
             return -1;
         }
-        printf("MakeSine: write to file %s \n", gOutFile);
+        printf("MakeSine: write to file %s \n", mOutFile);
         CreateSineFile();
-    } else if (gInFile[0] != 0 && gOutDevice >= 0) {
-        printf("Playback from file %s to stream %d\n", gInFile, gOutDevice);
+    } else if (mInFile[0] != 0 && mOutDevice >= 0) {
+        printf("Playback from file %s to stream %d\n", mInFile, mOutDevice);
         Playback();
-    } else if (gInDevice >= 0 && gOutFile[0] != 0) {
-        printf("Record from source %d to file %s\n", gInDevice, gOutFile);
+    } else if (mInDevice >= 0 && mOutFile[0] != 0) {
+        printf("Record from source %d to file %s\n", mInDevice, mOutFile);
         Record();
-    } else if (gInDevice >= 0 && gOutDevice >= 0){
-        printf("from source %d to stream %d\n", gInDevice, gOutDevice);
+    } else if (mInDevice >= 0 && mOutDevice >= 0){
+        printf("from source %d to stream %d\n", mInDevice, mOutDevice);
         RecordAndPlayback();
     }
 
@@ -618,10 +1498,10 @@ int exectue() {
 
 }
 
+static android::AudioDemo gDemo;
+
 void exitsig(int x) {
-    if (android::isPlaying || android::isRecording) {
-        android::isPlaying = false;
-        android::isRecording = false;
+    if (gDemo.Stop()) {
         printf("Stopping playback or record\n");
     } else {
         exit(x);
@@ -653,6 +1533,15 @@ static void showhelp(const char* cmd)
     fprintf(stderr, "        4 (default)\n");
     fprintf(stderr, "  --sine[=freq]\n");
     fprintf(stderr, "  --duration=<seconds>\n");
+    fprintf(stderr, "  --seek=<ms>: start input file at capture time, uses <in>.idx if present\n");
+    fprintf(stderr, "  --seek-frame=<frame>: start input file at frame\n");
+    fprintf(stderr, "  --loop: repeat the input file seamlessly until stopped\n");
+    fprintf(stderr, "  --report=<seconds>: print xrun/latency drift/cpu statistics (default 60 with --loop)\n");
+    fprintf(stderr, "  --repack: copy the input payload to the output file, adding or\n");
+    fprintf(stderr, "       stripping the wav header by file extension\n");
+    fprintf(stderr, "  --frames=<count>: number of frames to repack (default to end of input)\n");
+    fprintf(stderr, "  --append: append to the output file instead of truncating it\n");
+    fprintf(stderr, "  --trace=<file>: write per-stage timing as Chrome trace JSON at exit\n");
     fprintf(stderr, "  --help: print this help.\n");
 }
 
@@ -690,6 +1579,14 @@ int main(int argc, char** argv)
           { "duration",      required_argument, NULL,   't' },
           { "resample",      optional_argument, NULL,   'q' },
           { "sine",          optional_argument, NULL,   's' },
+          { "seek",          required_argument, NULL,   'k' },
+          { "seek-frame",    required_argument, NULL,   'f' },
+          { "trace",         required_argument, NULL,   'T' },
+          { "loop",          no_argument,       NULL,   'l' },
+          { "report",        required_argument, NULL,   'e' },
+          { "repack",        no_argument,       NULL,   'p' },
+          { "frames",        required_argument, NULL,   'n' },
+          { "append",        no_argument,       NULL,   'a' },
           { "help",          no_argument,       NULL,   'h' },
           { NULL,            0,                 NULL,    0  }
         };
@@ -702,28 +1599,40 @@ int main(int argc, char** argv)
         switch (ret) {
             case 'i':
                 if (optarg[0] >= '0' && optarg[0]<='9')
-                    android::gInDevice = (audio_source_t)atoi(optarg);
+                    gDemo.mInDevice = (audio_source_t)atoi(optarg);
                 else
-                    sprintf(android::gInFile, "%s", optarg);
+                    sprintf(gDemo.mInFile, "%s", optarg);
                 break;
             case 'o':
                 if (optarg[0] >= '0' && optarg[0]<='9')
-                    android::gOutDevice = (audio_stream_type_t)atoi(optarg);
+                    gDemo.mOutDevice = (audio_stream_type_t)atoi(optarg);
                 else
-                    sprintf(android::gOutFile, "%s", optarg);
+                    sprintf(gDemo.mOutFile, "%s", optarg);
                 break;
-            case 'c': android::gInChannelNum = atoi(optarg); break;
-            case 'C': android::gOutChannelNum = atoi(optarg); break;
-            case 'r': android::gInSampleRate = atoi(optarg); break;
-            case 'R': android::gOutSampleRate = atoi(optarg); break;
-            case 'b': android::gInBits = atoi(optarg); break;
-            case 'B': android::gOutBits = atoi(optarg); break;
+            case 'c': gDemo.mInChannelNum = atoi(optarg); break;
+            case 'C': gDemo.mOutChannelNum = atoi(optarg); break;
+            case 'r': gDemo.mInSampleRate = atoi(optarg); break;
+            case 'R': gDemo.mOutSampleRate = atoi(optarg); break;
+            case 'b': gDemo.mInBits = atoi(optarg); break;
+            case 'B': gDemo.mOutBits = atoi(optarg); break;
             case 't': alarm(atoi(optarg)); break;
-            case 'q': android::gResample = optarg?atoi(optarg):RESAMPLER_QUALITY_DEFAULT; break;
-            case 's': android::gSineFreq = optarg?atoi(optarg):SINE_FREQ; break;
+            case 'q': gDemo.mResample = optarg?atoi(optarg):RESAMPLER_QUALITY_DEFAULT; break;
+            case 's': gDemo.mSineFreq = optarg?atoi(optarg):SINE_FREQ; break;
+            case 'k': gDemo.mSeekMs = atoll(optarg); break;
+            case 'f': gDemo.mSeekFrame = atoll(optarg); break;
+            case 'l': gDemo.mLoop = true; break;
+            case 'e': gDemo.mReportSec = atoi(optarg); break;
+            case 'p': gDemo.mRepack = true; break;
+            case 'n': gDemo.mFrameCount = atoll(optarg); break;
+            case 'a': gDemo.mAppend = true; break;
+            case 'T':
+                sprintf(android::gTraceFile, "%s", optarg);
+                android::gTraceEnabled = true;
+                atexit(android::DumpTrace);
+                break;
             case 'h': default: showhelp(argv[0]); exit(-1); break;
         }
     }
 
-    return android::exectue();
+    return gDemo.Execute();
 }
@@ -3,16 +3,92 @@
 #ifndef AUDIODEMO_H_
 #define AUDIODEMO_H_
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <media/AudioTrack.h>
+#include <media/AudioRecord.h>
+
 namespace android {
 
+// Stream format resolved for a single run.
+struct PcmParams {
+    int channels;
+    int sampleRate;
+    int bits;
+};
+
 class AudioDemo{
 public:
     AudioDemo(void);
 
-    void Execute(void);
+    int Execute(void);
     int Playback();
     int Record();
     int RecordAndPlayback();
+    int Resample();
+    int Repack();
+    int CreateSineFile();
+
+    // Ask a running loop to finish; returns false if nothing was running.
+    // Only touches the volatile run flags, so it may be called from a
+    // signal handler.
+    bool Stop();
+
+    // Configuration, filled in before Execute(). -1 selects the default.
+    // Runs resolve defaults into a PcmParams and never write these back.
+    audio_source_t      mInDevice;
+    audio_stream_type_t mOutDevice;
+
+    int                 mInChannelNum;
+    int                 mOutChannelNum;
+
+    int                 mInSampleRate;
+    int                 mOutSampleRate;
+
+    int                 mInBits;
+    int                 mOutBits;
+
+    char                mInFile[512];
+    char                mOutFile[512];
+
+    int                 mResample;
+    int                 mSineFreq;
+    int                 mSineTime;
+
+    int64_t             mSeekFrame;
+    int64_t             mSeekMs;
+
+    bool                mRepack;
+    bool                mAppend;
+    int64_t             mFrameCount;
+
+    bool                mLoop;
+    int                 mReportSec;
+
+private:
+    int CheckPlaybackParams(const PcmParams& out);
+    int CheckRecordParams(const PcmParams& in);
+    sp<AudioTrack> allocAudioTrack(const PcmParams& out);
+    sp<AudioRecord> allocAudioRecord(const PcmParams& in);
+    int ParseWav(FILE* fp, PcmParams* in, int64_t* dataSize);
+
+    FILE* CreateIndex(const char* file, const PcmParams& in);
+    int64_t ResolveSeekFrame(const char* file, int sampleRate);
+    int SeekAudio(FILE* fp, const char* file, int sampleRate, int frameSize);
+
+    // Inner loops, instantiated per PcmFormat and selected once per run.
+    template <typename F>
+    int playbackLoop(FILE* fp, const sp<AudioTrack>& track, const PcmParams& in,
+            const PcmParams& out, off64_t loopStart, off64_t dataEnd);
+    template <typename F>
+    int recordLoop(const sp<AudioRecord>& record, const PcmParams& in, FILE* fp, FILE* idx);
+    template <typename F>
+    int duplexLoop(const sp<AudioRecord>& record, const sp<AudioTrack>& track, const PcmParams& in);
+
+    volatile bool       mPlaying;
+    volatile bool       mRecording;
 };
 
 };